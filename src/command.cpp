@@ -0,0 +1,250 @@
+#include "command.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "nvs_flash.h"
+
+
+static constexpr char TAG[] = "doorbell_cmd";
+
+static constexpr uint32_t COMMAND_STATE_MAGIC { 0x444f4f52 };
+static constexpr uint COMMAND_MIN_SLEEP_MIN { 1 };
+// Longest ack line: a 10 character sequence number or token, " error\n" and the terminator
+static constexpr size_t COMMAND_ACK_TOKEN_MAX { 10 };
+static constexpr size_t COMMAND_ACK_LINE_MAX { COMMAND_ACK_TOKEN_MAX + 7 + 1 };
+
+/*
+ * Payload format, one command per line:
+ *   <seq> <command> [argument]
+ *
+ * Commands are applied in order and every line is acked as "<seq> ok|dup|error".
+ * Sequence numbers at or below the last applied one are acked as "dup" without
+ * being applied again, so a retained command message can be delivered on every
+ * wake without side effects. A line without a valid sequence number is acked
+ * as "<first token> error". Once the ack buffer is full the remaining lines are
+ * dropped unapplied, so every applied command is acked exactly once.
+ */
+
+struct CommandState {
+    uint32_t magic;
+    uint32_t last_seq;
+    uint32_t sleep_min; // 0 = firmware default
+    bool muted;
+};
+
+static RTC_DATA_ATTR CommandState g_state;
+static volatile bool g_ring_pending;
+
+
+static bool parse_number(const char *str, uint32_t &value, char **end) {
+    if (!str || *str<'0' || *str>'9') {
+        return false;
+    }
+    errno = 0;
+    unsigned long v = strtoul(str, end, 10);
+    if (errno==ERANGE || v>UINT32_MAX) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+
+static bool parse_uint(const char *arg, uint &value) {
+    char *end;
+    uint32_t v;
+    if (!parse_number(arg, v, &end) || *end!='\0') {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+
+static bool parse_seq(char *line, uint32_t &seq, char **end) {
+    return parse_number(line, seq, end) && (**end==' ' || **end=='\t' || **end=='\0');
+}
+
+
+static bool cmd_mute(const char *arg) {
+    uint value;
+    if (!parse_uint(arg, value) || value>1) {
+        return false;
+    }
+    g_state.muted = value;
+    ESP_LOGI(TAG, "Mute %s", g_state.muted?"on":"off");
+    return true;
+}
+
+static bool cmd_sleep(const char *arg) {
+    uint minutes;
+    if (!parse_uint(arg, minutes)) {
+        return false;
+    }
+    if (minutes!=0 && (minutes<COMMAND_MIN_SLEEP_MIN || minutes>COMMAND_MAX_SLEEP_MIN)) {
+        return false;
+    }
+    g_state.sleep_min = minutes;
+    ESP_LOGI(TAG, "Sleep interval %u min", minutes);
+    return true;
+}
+
+static bool cmd_ring(const char *arg) {
+    g_ring_pending = true;
+    ESP_LOGI(TAG, "Remote ring");
+    return true;
+}
+
+
+struct Command {
+    const char *name;
+    bool (*handler)(const char *arg);
+};
+
+static constexpr Command COMMANDS[] = {
+    { "mute",  cmd_mute  },
+    { "sleep", cmd_sleep },
+    { "ring",  cmd_ring  },
+};
+
+
+
+static void command_save() {
+    nvs_handle handle;
+    if (nvs_open("cmd", NVS_READWRITE, &handle)!=ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS");
+        return;
+    }
+    nvs_set_blob(handle, "state", &g_state, sizeof(g_state));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+
+void command_init() {
+    if (g_state.magic==COMMAND_STATE_MAGIC && esp_sleep_get_wakeup_cause()!=ESP_SLEEP_WAKEUP_UNDEFINED) {
+        // RTC memory survived deep sleep
+        return;
+    }
+
+    memset(&g_state, 0x00, sizeof(g_state));
+    g_state.magic = COMMAND_STATE_MAGIC;
+
+    nvs_handle handle;
+    if (nvs_open("cmd", NVS_READONLY, &handle)==ESP_OK) {
+        CommandState state;
+        size_t sz = sizeof(state);
+        if (nvs_get_blob(handle, "state", &state, &sz)==ESP_OK && sz==sizeof(state) && state.magic==COMMAND_STATE_MAGIC) {
+            g_state = state;
+        }
+        nvs_close(handle);
+    }
+    ESP_LOGI(TAG, "Command state: seq=%lu muted=%d sleep=%lu", g_state.last_seq, g_state.muted, g_state.sleep_min);
+}
+
+
+
+static const char *command_dispatch(uint32_t seq, char *line) {
+    if (seq<=g_state.last_seq) {
+        return "dup";
+    }
+
+    char *save;
+    char *name = strtok_r(line, " \t", &save);
+    char *arg = strtok_r(nullptr, " \t", &save);
+    if (!name) {
+        return "error";
+    }
+
+    for (const auto &cmd : COMMANDS) {
+        if (strcmp(cmd.name, name)==0) {
+            if (!cmd.handler(arg)) {
+                return "error";
+            }
+            g_state.last_seq = seq;
+            return "ok";
+        }
+    }
+    ESP_LOGW(TAG, "Unknown command: %s", name);
+    return "error";
+}
+
+
+size_t command_process(const char *data, size_t len, char *ack, size_t ack_size) {
+    char buf[256];
+    size_t ack_len = 0;
+    bool changed = false;
+
+    if (len>=sizeof(buf)) {
+        ESP_LOGE(TAG, "Command payload too large (%u bytes)", (uint)len);
+        return 0;
+    }
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+
+    char *save;
+    for (char *line = strtok_r(buf, "\r\n", &save); line; line = strtok_r(nullptr, "\r\n", &save)) {
+        if (ack_size-ack_len<COMMAND_ACK_LINE_MAX) {
+            ESP_LOGW(TAG, "Ack buffer full, dropping: %s", line);
+            break;
+        }
+
+        int n;
+        char *end;
+        uint32_t seq;
+        if (parse_seq(line, seq, &end)) {
+            auto res = command_dispatch(seq, end);
+            if (strcmp(res, "ok")==0) {
+                changed = true;
+            }
+            n = snprintf(ack+ack_len, ack_size-ack_len, "%" PRIu32 " %s\n", seq, res);
+        }
+        else {
+            ESP_LOGW(TAG, "Invalid sequence number: %s", line);
+            int token_len = strcspn(line, " \t");
+            if (token_len>(int)COMMAND_ACK_TOKEN_MAX) {
+                token_len = COMMAND_ACK_TOKEN_MAX;
+            }
+            n = snprintf(ack+ack_len, ack_size-ack_len, "%.*s error\n", token_len, line);
+        }
+        if (n>0) {
+            ack_len += n;
+        }
+    }
+
+    if (changed) {
+        command_save();
+    }
+
+    return ack_len;
+}
+
+
+bool command_muted() {
+    return g_state.muted;
+}
+
+uint32_t command_sleep_min() {
+    return g_state.sleep_min;
+}
+
+uint64_t command_sleep_duration_us(uint64_t default_us) {
+    if (g_state.sleep_min==0) {
+        return default_us;
+    }
+    return g_state.sleep_min * 60ull * 1000000ull;
+}
+
+bool command_take_ring() {
+    if (!g_ring_pending) {
+        return false;
+    }
+    g_ring_pending = false;
+    return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Longest interval the "sleep" command accepts
+static constexpr uint32_t COMMAND_MAX_SLEEP_MIN { 24*60 };
+
+void command_init();
+
+size_t command_process(const char *data, size_t len, char *ack, size_t ack_size);
+
+bool command_muted();
+uint32_t command_sleep_min();
+uint64_t command_sleep_duration_us(uint64_t default_us);
+bool command_take_ring();
@@ -0,0 +1,125 @@
+#include "discovery.h"
+
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "nvs_flash.h"
+
+#include "command.h"
+#include "topics.h"
+
+
+static constexpr char TAG[] = "doorbell_disc";
+
+static constexpr char DISCOVERY_PREFIX[] = "homeassistant";
+static constexpr uint32_t DISCOVERY_HASH_MAGIC { 0x48415353 };
+
+static constexpr uint32_t FNV_OFFSET { 2166136261u };
+static constexpr uint32_t FNV_PRIME  { 16777619u };
+
+// Home Assistant fills in the command sequence number from the clock. Seconds
+// keep it within 32 bits and above any hand-numbered commands, but a second
+// command within the same second is acked as "dup".
+#define DISCOVERY_COMMAND(command) "\"cmd_t\":\"" MQTT_PREFIX "/command\",\"cmd_tpl\":\"{{ now().timestamp() | int }} " command "\""
+
+static_assert(COMMAND_MAX_SLEEP_MIN==24*60, "Update the sleep interval max below");
+
+const DiscoveryEntity DISCOVERY_ENTITIES[] = {
+    { "binary_sensor", "button", "Button", MQTT_BUTTON_TOPIC, "\"pl_on\":\"on\",\"pl_off\":\"off\"" },
+    { "sensor", "battery_voltage", "Battery voltage", MQTT_BATTERY_VOLTAGE_TOPIC, "\"dev_cla\":\"voltage\",\"unit_of_meas\":\"V\",\"stat_cla\":\"measurement\"" },
+    { "sensor", "battery_percent", "Battery", MQTT_BATTERY_PERCENT_TOPIC, "\"dev_cla\":\"battery\",\"unit_of_meas\":\"%\",\"stat_cla\":\"measurement\"" },
+    { "switch", "mute", "Mute", MQTT_MUTE_TOPIC, DISCOVERY_COMMAND("mute {{ value }}") ",\"pl_on\":\"1\",\"pl_off\":\"0\",\"ic\":\"mdi:bell-off\"" },
+    { "number", "sleep", "Sleep interval", MQTT_SLEEP_TOPIC, DISCOVERY_COMMAND("sleep {{ value | int }}") ",\"min\":0,\"max\":1440,\"mode\":\"box\",\"unit_of_meas\":\"min\",\"ent_cat\":\"config\"" },
+    { "button", "ring", "Ring", nullptr, DISCOVERY_COMMAND("ring") },
+    { "sensor", "command_ack", "Command ack", MQTT_COMMAND_ACK_TOPIC, "\"ent_cat\":\"diagnostic\"" },
+};
+const size_t DISCOVERY_ENTITY_COUNT { sizeof(DISCOVERY_ENTITIES)/sizeof(DISCOVERY_ENTITIES[0]) };
+
+static char g_topic_buf[96];
+static char g_payload_buf[512];
+
+// Hash of the last published discovery payloads, mirrored in NVS for cold boots
+static RTC_DATA_ATTR uint32_t g_hash_magic;
+static RTC_DATA_ATTR uint32_t g_hash;
+
+
+
+const char *discovery_build(const DiscoveryEntity &entity, const char *node_id, const DiscoveryFirmware &firmware, const char **topic) {
+    snprintf(g_topic_buf, sizeof(g_topic_buf), "%s/%s/%s/%s/config", DISCOVERY_PREFIX, entity.component, node_id, entity.object_id);
+    *topic = g_topic_buf;
+
+    int n = snprintf(g_payload_buf, sizeof(g_payload_buf),
+        "{\"name\":\"%s\",\"uniq_id\":\"%s_%s\",%s%s%s%s%s"
+        "\"dev\":{\"ids\":[\"%s\"],\"name\":\"Doorbell\",\"mdl\":\"XIAO ESP32C3\",\"sw\":\"%s\"}}",
+        entity.name, node_id, entity.object_id,
+        entity.state_topic ? "\"stat_t\":\"" : "", entity.state_topic ? entity.state_topic : "", entity.state_topic ? "\"," : "",
+        entity.extra ? entity.extra : "", entity.extra ? "," : "",
+        node_id, firmware.version);
+    if (n<0 || n>=(int)sizeof(g_payload_buf)) {
+        ESP_LOGE(TAG, "Discovery payload for %s truncated", entity.object_id);
+    }
+    return g_payload_buf;
+}
+
+
+
+static uint32_t fnv1a(uint32_t hash, const char *data, size_t len) {
+    for (size_t i=0; i<len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+uint32_t discovery_hash(const DiscoveryEntity *entities, size_t count, const char *node_id, const DiscoveryFirmware &firmware, const char *broker) {
+    uint32_t hash = FNV_OFFSET;
+
+    // Any firmware change republishes, even if the payloads are unchanged
+    hash = fnv1a(hash, firmware.id, strlen(firmware.id)+1);
+    // A new broker does not have the retained configs
+    hash = fnv1a(hash, broker, strlen(broker)+1);
+
+    for (size_t i=0; i<count; i++) {
+        const char *topic;
+        const char *payload = discovery_build(entities[i], node_id, firmware, &topic);
+        hash = fnv1a(hash, topic, strlen(topic)+1);
+        hash = fnv1a(hash, payload, strlen(payload)+1);
+    }
+    return hash;
+}
+
+
+bool discovery_needed(uint32_t hash) {
+    if (g_hash_magic!=DISCOVERY_HASH_MAGIC || esp_sleep_get_wakeup_cause()==ESP_SLEEP_WAKEUP_UNDEFINED) {
+        g_hash_magic = DISCOVERY_HASH_MAGIC;
+        g_hash = 0;
+
+        nvs_handle handle;
+        if (nvs_open("discovery", NVS_READONLY, &handle)==ESP_OK) {
+            nvs_get_u32(handle, "hash", &g_hash);
+            nvs_close(handle);
+        }
+    }
+    return g_hash!=hash;
+}
+
+
+void discovery_store(uint32_t hash) {
+    if (g_hash==hash) {
+        return;
+    }
+    g_hash = hash;
+
+    nvs_handle handle;
+    if (nvs_open("discovery", NVS_READWRITE, &handle)!=ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS");
+        return;
+    }
+    nvs_set_u32(handle, "hash", hash);
+    nvs_commit(handle);
+    nvs_close(handle);
+    ESP_LOGI(TAG, "Stored discovery hash 0x%08lx", hash);
+}
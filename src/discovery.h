@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct DiscoveryEntity {
+    const char *component;
+    const char *object_id;
+    const char *name;
+    const char *state_topic;    // nullptr for stateless entities
+    const char *extra;  // Additional JSON members, or nullptr
+};
+
+// Firmware identity that goes into the payloads and the hash
+struct DiscoveryFirmware {
+    const char *id;         // Changes with every build, e.g. the ELF SHA
+    const char *version;
+};
+
+// Entities the firmware exposes to Home Assistant
+extern const DiscoveryEntity DISCOVERY_ENTITIES[];
+extern const size_t DISCOVERY_ENTITY_COUNT;
+
+const char *discovery_build(const DiscoveryEntity &entity, const char *node_id, const DiscoveryFirmware &firmware, const char **topic);
+
+uint32_t discovery_hash(const DiscoveryEntity *entities, size_t count, const char *node_id, const DiscoveryFirmware &firmware, const char *broker);
+bool discovery_needed(uint32_t hash);
+void discovery_store(uint32_t hash);
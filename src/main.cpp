@@ -9,6 +9,7 @@
 
 #include "battery.h"
 #include "network.h"
+#include "command.h"
 
 
 extern "C" {
@@ -38,7 +39,7 @@ static constexpr char TAG[] = "doorbell";
 
 
 static void dingdong() {
-    gpio_set_level(RELAY_PIN, 1);
+    gpio_set_level(RELAY_PIN, command_muted() ? 0 : 1);
     vTaskDelay(pdMS_TO_TICKS(DINGDONG_HIGH_MS));
 
     gpio_set_level(RELAY_PIN, 0);
@@ -65,7 +66,18 @@ static void trigger_dingdong() {
 
 
 
+static void remote_dingdong() {
+    printf("Remote ring\n");
+    for (uint i=0; i<DINGDONG_MIN_COUNT; i++) {
+        dingdong();
+    }
+}
+
+
+
 static void enter_sleep() {
+    esp_sleep_enable_timer_wakeup(command_sleep_duration_us(SLEEP_DURATION_US));
+
     printf("Sleeeping\n");
     fflush(stdout);
     if constexpr (ENABLE_SLEEP) {
@@ -107,8 +119,9 @@ static void app_init() {
     }
     ESP_ERROR_CHECK(ret);
 
-    // Configure sleep modes
-    esp_sleep_enable_timer_wakeup(SLEEP_DURATION_US);
+    command_init();
+
+    // Configure sleep modes (timer wakeup is set in enter_sleep)
     esp_sleep_enable_gpio_wakeup();
     esp_deep_sleep_enable_gpio_wakeup(1ULL<<BUTTON_PIN, ESP_GPIO_WAKEUP_GPIO_LOW);
 
@@ -151,6 +164,9 @@ void app_main(void)
             trigger_dingdong();
             last_trigger = xTaskGetTickCount();
         }
+        if (command_take_ring()) {
+            remote_dingdong();
+        }
 
         vTaskDelay(pdMS_TO_TICKS(10));
         if ( (xTaskGetTickCount()-last_trigger) > awake_duration ) {
@@ -161,6 +177,12 @@ void app_main(void)
     printf("Exit loop\n");
 
     network_term();
+
+    // Commands may arrive while the network task drains the session
+    if (command_take_ring()) {
+        remote_dingdong();
+    }
+
     enter_sleep();
 
     // Sleep failed!
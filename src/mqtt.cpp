@@ -5,14 +5,22 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_system.h"
 #include "esp_event.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_app_desc.h"
 #include "nvs_flash.h"
 #include "mqtt_client.h"
 
 #include "battery.h"
+#include "command.h"
+#include "discovery.h"
+#include "mqtt_wire.h"
+#include "topics.h"
 
 //#define CONFIGURE_MQTT
 
@@ -26,10 +34,21 @@ static constexpr char CFG_MQTT_ADDRESS[] = "mqtt://<IP>";
 
 static constexpr char TAG[] = "doorbell_mqtt";
 
-#define MQTT_PREFIX "doorbell"
-static constexpr char MQTT_BUTTON_TOPIC[] = MQTT_PREFIX "/button";
-static constexpr char MQTT_BATTERY_VOLTAGE_TOPIC[] = MQTT_PREFIX "/battery_voltage";
-static constexpr char MQTT_BATTERY_PERCENT_TOPIC[] = MQTT_PREFIX "/battery_percent";
+// Bump when the subscriptions change, so devices with an existing persistent
+// session subscribe again
+static constexpr uint32_t MQTT_SUBSCRIPTION_VERSION { 1 };
+
+static constexpr TickType_t MQTT_TERM_TIMEOUT_MS { 500 };
+
+// MQTT 5 is opt-in (CONFIG_MQTT_PROTOCOL_5): its properties cost 26-32 bytes
+// more per wake than 3.1.1, see test_wire.
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static constexpr bool MQTT_ENABLE_V5 { true };
+#else
+static constexpr bool MQTT_ENABLE_V5 { false };
+#endif
+
+static constexpr int MQTT5_REASON_UNSUPPORTED_PROTOCOL { 0x84 };
 
 
 static char MQTT_ADDRESS[64];
@@ -46,6 +65,63 @@ static EventGroupHandle_t g_mqtt_event_group;
 
 static esp_mqtt_client_handle_t g_client;
 
+static SemaphoreHandle_t g_ack_mutex;
+static char g_ack_buf[256];
+static size_t g_ack_len;
+// Set once the batch ack is out; later commands are left for the next wake
+static bool g_ack_sent;
+
+// Set when the broker refused MQTT 5, fall back to 3.1.1 until next cold boot
+static RTC_DATA_ATTR bool g_v5_refused;
+static bool g_v5;
+static WireConnection g_wire;
+// Broker had no session for us, so it may have lost the retained configs too
+static volatile bool g_discovery_requested;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static mqtt5_user_property_handle_t g_wake_property;
+#endif
+
+// Subscription version the broker session is known to have, mirrored in NVS
+static RTC_DATA_ATTR uint32_t g_subscription_version;
+static int g_subscribe_msg_id;
+static volatile bool g_subscribed;
+
+
+static void mqtt_load_subscription(nvs_handle handle) {
+    g_subscribe_msg_id = -1;
+    g_subscribed = false;
+    if (g_subscription_version==0) {
+        nvs_get_u32(handle, "sub_version", &g_subscription_version);
+    }
+}
+
+
+static void mqtt_subscribe(esp_mqtt_client_handle_t client, bool session_present) {
+    // A persistent session keeps the subscription, and the broker delivers
+    // queued commands right after CONNACK without another round trip.
+    if (session_present && g_subscription_version==MQTT_SUBSCRIPTION_VERSION) {
+        return;
+    }
+    g_subscribe_msg_id = esp_mqtt_client_subscribe(client, MQTT_COMMAND_TOPIC, 1);
+}
+
+
+// Remember the version once the broker has confirmed the subscription
+static void mqtt_store_subscription() {
+    if (!g_subscribed || g_subscription_version==MQTT_SUBSCRIPTION_VERSION) {
+        return;
+    }
+    g_subscription_version = MQTT_SUBSCRIPTION_VERSION;
+
+    nvs_handle handle;
+    if (nvs_open("mqtt", NVS_READWRITE, &handle)!=ESP_OK) {
+        return;
+    }
+    nvs_set_u32(handle, "sub_version", g_subscription_version);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
 
 static void log_error_if_nonzero(const char *message, int error_code)
 {
@@ -61,7 +137,13 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)event_data;
     switch ((esp_mqtt_event_id_t)event_id) {
     case MQTT_EVENT_CONNECTED:
-        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session_present=%d", event->session_present);
+        // Broker CONNACK properties are not exposed, count them as empty
+        wire_connect(g_wire, strlen(MQTT_CLIENT_ID), strlen(MQTT_USER), strlen(MQTT_PASSWORD), 0);
+        mqtt_subscribe(event->client, event->session_present);
+        if (!event->session_present) {
+            g_discovery_requested = true;
+        }
         xEventGroupSetBits(g_mqtt_event_group, MQTT_CONNECTED_BIT);
         break;
     case MQTT_EVENT_DISCONNECTED:
@@ -71,6 +153,9 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        if (event->msg_id==g_subscribe_msg_id) {
+            g_subscribed = true;
+        }
         break;
     case MQTT_EVENT_UNSUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
@@ -82,6 +167,20 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         ESP_LOGI(TAG, "MQTT_EVENT_DATA");
         printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
         printf("DATA=%.*s\r\n", event->data_len, event->data);
+        if (event->topic_len==strlen(MQTT_COMMAND_TOPIC) && strncmp(event->topic, MQTT_COMMAND_TOPIC, event->topic_len)==0) {
+            if (event->data_len!=event->total_data_len) {
+                ESP_LOGE(TAG, "Fragmented command payload ignored");
+                break;
+            }
+            xSemaphoreTake(g_ack_mutex, portMAX_DELAY);
+            if (g_ack_sent) {
+                ESP_LOGW(TAG, "Command after ack ignored");
+            }
+            else {
+                g_ack_len += command_process(event->data, event->data_len, g_ack_buf+g_ack_len, sizeof(g_ack_buf)-g_ack_len);
+            }
+            xSemaphoreGive(g_ack_mutex);
+        }
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -92,6 +191,14 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             ESP_LOGI(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
 
         }
+        else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+            auto code = event->error_handle->connect_return_code;
+            ESP_LOGI(TAG, "Connection refused (0x%x)", code);
+            if (g_v5 && (code == MQTT_CONNECTION_REFUSE_PROTOCOL || code == MQTT5_REASON_UNSUPPORTED_PROTOCOL)) {
+                ESP_LOGW(TAG, "Broker refused MQTT 5, using 3.1.1 from next wake");
+                g_v5_refused = true;
+            }
+        }
         xEventGroupSetBits(g_mqtt_event_group, MQTT_FAIL_BIT);
         break;
     default:
@@ -102,11 +209,66 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
 
 
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static const char *wake_cause_name() {
+    switch (esp_sleep_get_wakeup_cause()) {
+        case ESP_SLEEP_WAKEUP_TIMER:
+            return "timer";
+        case ESP_SLEEP_WAKEUP_GPIO:
+            return "gpio";
+        case ESP_SLEEP_WAKEUP_UNDEFINED:
+            return "reset";
+        default:
+            return "other";
+    }
+}
+
+
+static void mqtt5_configure() {
+    esp_mqtt5_connection_property_config_t connect_property;
+    memset(&connect_property, 0x00, sizeof(connect_property));
+    connect_property.session_expiry_interval = wire_session_expiry_s();
+    esp_mqtt5_client_set_connect_property(g_client, &connect_property);
+
+    g_wire.wake_cause = wake_cause_name();
+    esp_mqtt5_user_property_item_t items[] = {
+        { WIRE_WAKE_PROPERTY, g_wire.wake_cause },
+    };
+    esp_mqtt5_client_set_user_property(&g_wake_property, items, sizeof(items)/sizeof(items[0]));
+}
+#endif
+
+
+static int mqtt_publish(const WireMessage &msg) {
+    #ifdef CONFIG_MQTT_PROTOCOL_5
+    if (g_v5) {
+        esp_mqtt5_publish_property_config_t property;
+        memset(&property, 0x00, sizeof(property));
+        property.message_expiry_interval = msg.expiry_s;
+        if (msg.wake_property) {
+            property.user_property = g_wake_property;
+        }
+        esp_mqtt5_client_set_publish_property(g_client, &property);
+    }
+    #endif
+
+    auto msg_id = esp_mqtt_client_publish(g_client, msg.topic, msg.data, msg.len, WIRE_QOS, msg.retain);
+    if (msg_id>=0) {
+        wire_publish(g_wire, msg);
+    }
+    return msg_id;
+}
+
+
+
 
 void mqtt_init() {
     size_t sz;
 
     g_mqtt_event_group = xEventGroupCreate();
+    g_ack_mutex = xSemaphoreCreateMutex();
+    g_ack_len = 0;
+    g_ack_sent = false;
 
     uint8_t mac[6];
     esp_read_mac(mac, ESP_MAC_WIFI_STA);
@@ -129,6 +291,12 @@ void mqtt_init() {
     esp_mqtt_client_config_t mqtt_cfg;
     memset(&mqtt_cfg, 0x00, sizeof(mqtt_cfg));
     mqtt_cfg.credentials.client_id = MQTT_CLIENT_ID;
+    mqtt_cfg.session.disable_clean_session = true;
+
+    g_v5 = MQTT_ENABLE_V5 && !g_v5_refused;
+    mqtt_cfg.session.protocol_ver = g_v5 ? MQTT_PROTOCOL_V_5 : MQTT_PROTOCOL_V_3_1_1;
+    printf("MQTT protocol: %s\n", g_v5 ? "5" : "3.1.1");
+    g_wire = { g_v5, nullptr, 0 };
 
     ESP_ERROR_CHECK(nvs_open("mqtt", NVS_READONLY, &handle));
     sz = sizeof(MQTT_ADDRESS);
@@ -137,6 +305,7 @@ void mqtt_init() {
     nvs_get_str(handle, "mqtt_user", MQTT_USER, &sz);
     sz = sizeof(MQTT_PASSWORD);
     nvs_get_str(handle, "mqtt_password", MQTT_PASSWORD, &sz);
+    mqtt_load_subscription(handle);
     nvs_close(handle);
 
     mqtt_cfg.broker.address.uri = MQTT_ADDRESS;
@@ -145,6 +314,11 @@ void mqtt_init() {
 
     
     g_client = esp_mqtt_client_init(&mqtt_cfg);
+    #ifdef CONFIG_MQTT_PROTOCOL_5
+    if (g_v5) {
+        mqtt5_configure();
+    }
+    #endif
     esp_mqtt_client_register_event(g_client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, g_client);
     esp_mqtt_client_start(g_client);
 
@@ -159,32 +333,110 @@ void mqtt_init() {
 }
 
 
-void mqtt_term() {
-    TickType_t start = xTaskGetTickCount();
+static void mqtt_flush(TickType_t start) {
     auto bits = xEventGroupGetBits(g_mqtt_event_group);
     while ((bits & MQTT_CONNECTED_BIT) && !(bits & MQTT_FAIL_BIT) && esp_mqtt_client_get_outbox_size(g_client)) {
-        vTaskDelay(pdTICKS_TO_MS(20));
-        if ((xTaskGetTickCount()-start)>pdTICKS_TO_MS(500)) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+        if ((xTaskGetTickCount()-start)>pdMS_TO_TICKS(MQTT_TERM_TIMEOUT_MS)) {
             break;
         }
+        bits = xEventGroupGetBits(g_mqtt_event_group);
+    }
+}
+
+
+static void mqtt_send_command_state() {
+    char buf[16];
+    mqtt_publish(wire_mute_message(command_muted()));
+    mqtt_publish(wire_sleep_message(command_sleep_min(), buf, sizeof(buf)));
+}
+
+
+static void mqtt_send_command_ack() {
+    xSemaphoreTake(g_ack_mutex, portMAX_DELAY);
+    if (g_ack_len) {
+        auto msg_id = mqtt_publish(wire_command_ack_message(g_ack_buf, g_ack_len));
+        ESP_LOGI(TAG, "sent command ack, msg_id=%d", msg_id);
+        g_ack_len = 0;
+        mqtt_send_command_state();
     }
+    g_ack_sent = true;
+    xSemaphoreGive(g_ack_mutex);
+}
 
+
+static void mqtt_send_discovery() {
+    char elf_sha[17];
+    esp_app_get_elf_sha256(elf_sha, sizeof(elf_sha));
+    DiscoveryFirmware firmware = { elf_sha, esp_app_get_description()->version };
+
+    uint32_t hash = discovery_hash(DISCOVERY_ENTITIES, DISCOVERY_ENTITY_COUNT, MQTT_CLIENT_ID, firmware, MQTT_ADDRESS);
+    bool needed = discovery_needed(hash);
+    if (!needed && !g_discovery_requested) {
+        return;
+    }
+    if (!(xEventGroupGetBits(g_mqtt_event_group) & MQTT_CONNECTED_BIT)) {
+        return;
+    }
+    g_discovery_requested = false;
+
+    ESP_LOGI(TAG, "Publishing discovery (hash 0x%08lx)", hash);
+    bool ok = true;
+    for (size_t i=0; i<DISCOVERY_ENTITY_COUNT; i++) {
+        const char *topic;
+        const char *payload = discovery_build(DISCOVERY_ENTITIES[i], MQTT_CLIENT_ID, firmware, &topic);
+        if (mqtt_publish(wire_retained_message(topic, payload))<0) {
+            ok = false;
+        }
+    }
+    // The broker may have lost the retained states along with the configs
+    mqtt_send_command_state();
+    if (!ok) {
+        return;
+    }
+
+    // Only remember the hash once the broker has acknowledged the configs
+    mqtt_flush(xTaskGetTickCount());
+    if (esp_mqtt_client_get_outbox_size(g_client)==0) {
+        discovery_store(hash);
+    }
+}
+
+
+void mqtt_term() {
+    TickType_t start = xTaskGetTickCount();
+
+    // Commands are delivered ahead of the PUBACKs for this wake's publishes,
+    // so once the outbox is empty all pending commands have been applied.
+    mqtt_flush(start);
+    mqtt_store_subscription();
+    mqtt_send_command_ack();
+    mqtt_send_discovery();
+    mqtt_flush(start);
+
+    wire_disconnect(g_wire);
+    ESP_LOGI(TAG, "MQTT %s bytes this wake: %u", g_v5 ? "5" : "3.1.1", (uint)g_wire.bytes);
     esp_mqtt_client_stop(g_client);
+
+    #ifdef CONFIG_MQTT_PROTOCOL_5
+    if (g_wake_property) {
+        esp_mqtt5_client_delete_user_property(g_wake_property);
+        g_wake_property = nullptr;
+    }
+    #endif
 }
 
 
 void mqtt_send_button(bool state) {
-    auto msg_id = esp_mqtt_client_publish(g_client, MQTT_BUTTON_TOPIC, state?"on":"off", 0, 1, 1);
+    auto msg_id = mqtt_publish(wire_button_message(state));
     ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
 }
 
 void mqtt_send_battery(uint voltage_mv) {
     char buf[32];
-    sprintf(buf, "%.2f", voltage_mv/1000.0);
-    auto msg_id = esp_mqtt_client_publish(g_client, MQTT_BATTERY_VOLTAGE_TOPIC, buf, 0, 1, 1);
+    auto msg_id = mqtt_publish(wire_battery_voltage_message(voltage_mv, buf, sizeof(buf)));
     ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
 
-    sprintf(buf, "%u", battery_to_percent(voltage_mv));
-    msg_id = esp_mqtt_client_publish(g_client, MQTT_BATTERY_PERCENT_TOPIC, buf, 0, 1, 1);
+    msg_id = mqtt_publish(wire_battery_percent_message(battery_to_percent(voltage_mv), buf, sizeof(buf)));
     ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
 }
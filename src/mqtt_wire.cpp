@@ -0,0 +1,133 @@
+#include "mqtt_wire.h"
+
+#include <string.h>
+
+#include "command.h"
+#include "topics.h"
+
+
+static constexpr uint32_t WIRE_BUTTON_PRESS_EXPIRY_S { 60 };
+static constexpr uint32_t WIRE_SESSION_EXPIRY_WAKES { 2 };
+
+static constexpr size_t WIRE_PROPERTY_U32_SIZE { 1+4 };
+
+
+
+WireMessage wire_button_message(bool state) {
+    // An unseen press is stale after a minute, let the broker drop it
+    const char *data = state ? "on" : "off";
+    return { MQTT_BUTTON_TOPIC, data, (int)strlen(data), 1, state ? WIRE_BUTTON_PRESS_EXPIRY_S : 0, false };
+}
+
+
+WireMessage wire_battery_voltage_message(uint32_t voltage_mv, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%.2f", voltage_mv/1000.0);
+    // Once per wake, so it carries the wake cause
+    return { MQTT_BATTERY_VOLTAGE_TOPIC, buf, len, 1, 0, true };
+}
+
+
+WireMessage wire_battery_percent_message(uint32_t percent, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%u", (unsigned)percent);
+    return { MQTT_BATTERY_PERCENT_TOPIC, buf, len, 1, 0, false };
+}
+
+
+WireMessage wire_command_ack_message(const char *ack, size_t len) {
+    return { MQTT_COMMAND_ACK_TOPIC, ack, (int)len, 0, 0, false };
+}
+
+
+WireMessage wire_mute_message(bool muted) {
+    return { MQTT_MUTE_TOPIC, muted ? "1" : "0", 1, 1, 0, false };
+}
+
+
+WireMessage wire_sleep_message(uint32_t minutes, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%u", (unsigned)minutes);
+    return { MQTT_SLEEP_TOPIC, buf, len, 1, 0, false };
+}
+
+
+WireMessage wire_retained_message(const char *topic, const char *data) {
+    return { topic, data, (int)strlen(data), 1, 0, false };
+}
+
+
+uint32_t wire_session_expiry_s() {
+    // Keep the session (and queued commands) across deep sleep. The expiry is
+    // sized for the longest sleep interval, since a "sleep" command applied
+    // later in a wake can extend the next sleep past the current one.
+    return WIRE_SESSION_EXPIRY_WAKES * COMMAND_MAX_SLEEP_MIN * 60;
+}
+
+
+
+static size_t varint_size(size_t value) {
+    size_t sz = 1;
+    while (value>=128) {
+        value /= 128;
+        sz++;
+    }
+    return sz;
+}
+
+
+static size_t packet_size(size_t remaining) {
+    return 1 + varint_size(remaining) + remaining;
+}
+
+
+static size_t properties_size(size_t property_size) {
+    return varint_size(property_size) + property_size;
+}
+
+
+size_t wire_connect(WireConnection &conn, size_t client_id_len, size_t user_len, size_t password_len, size_t connack_property_size) {
+    // Protocol name, level, flags and keep alive
+    size_t remaining = 2+4 + 1 + 1 + 2;
+    if (conn.v5) {
+        remaining += properties_size(WIRE_PROPERTY_U32_SIZE);
+    }
+    remaining += 2+client_id_len;
+    if (user_len) {
+        remaining += 2+user_len;
+    }
+    if (password_len) {
+        remaining += 2+password_len;
+    }
+    size_t bytes = packet_size(remaining);
+
+    // CONNACK
+    bytes += packet_size(2 + (conn.v5 ? properties_size(connack_property_size) : 0));
+
+    conn.bytes += bytes;
+    return bytes;
+}
+
+
+size_t wire_publish(WireConnection &conn, const WireMessage &msg) {
+    size_t remaining = 2+strlen(msg.topic) + 2 + msg.len;
+    if (conn.v5) {
+        size_t props = 0;
+        if (msg.expiry_s) {
+            props += WIRE_PROPERTY_U32_SIZE;
+        }
+        if (msg.wake_property && conn.wake_cause) {
+            props += 1 + 2+strlen(WIRE_WAKE_PROPERTY) + 2+strlen(conn.wake_cause);
+        }
+        remaining += properties_size(props);
+    }
+    // PUBLISH and its PUBACK, MQTT 5 omits the reason code on success
+    size_t bytes = packet_size(remaining) + packet_size(2);
+
+    conn.bytes += bytes;
+    return bytes;
+}
+
+
+size_t wire_disconnect(WireConnection &conn) {
+    size_t bytes = packet_size(0);
+    conn.bytes += bytes;
+    return bytes;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+static constexpr int WIRE_QOS { 1 };
+static constexpr char WIRE_WAKE_PROPERTY[] = "wake";
+
+// One PUBLISH as the firmware sends it
+struct WireMessage {
+    const char *topic;
+    const char *data;
+    int len;
+    int retain;
+    uint32_t expiry_s;      // MQTT 5 message expiry, 0 for none
+    bool wake_property;     // MQTT 5 wake cause user property
+};
+
+// Bytes on air for one connection, both directions
+struct WireConnection {
+    bool v5;
+    const char *wake_cause;
+    size_t bytes;
+};
+
+WireMessage wire_button_message(bool state);
+WireMessage wire_battery_voltage_message(uint32_t voltage_mv, char *buf, size_t size);
+WireMessage wire_battery_percent_message(uint32_t percent, char *buf, size_t size);
+WireMessage wire_command_ack_message(const char *ack, size_t len);
+WireMessage wire_mute_message(bool muted);
+WireMessage wire_sleep_message(uint32_t minutes, char *buf, size_t size);
+WireMessage wire_retained_message(const char *topic, const char *data);
+
+uint32_t wire_session_expiry_s();
+
+size_t wire_connect(WireConnection &conn, size_t client_id_len, size_t user_len, size_t password_len, size_t connack_property_size);
+size_t wire_publish(WireConnection &conn, const WireMessage &msg);
+size_t wire_disconnect(WireConnection &conn);
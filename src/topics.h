@@ -0,0 +1,10 @@
+#pragma once
+
+#define MQTT_PREFIX "doorbell"
+static constexpr char MQTT_BUTTON_TOPIC[] = MQTT_PREFIX "/button";
+static constexpr char MQTT_BATTERY_VOLTAGE_TOPIC[] = MQTT_PREFIX "/battery_voltage";
+static constexpr char MQTT_BATTERY_PERCENT_TOPIC[] = MQTT_PREFIX "/battery_percent";
+static constexpr char MQTT_MUTE_TOPIC[] = MQTT_PREFIX "/mute";
+static constexpr char MQTT_SLEEP_TOPIC[] = MQTT_PREFIX "/sleep";
+static constexpr char MQTT_COMMAND_TOPIC[] = MQTT_PREFIX "/command";
+static constexpr char MQTT_COMMAND_ACK_TOPIC[] = MQTT_PREFIX "/command/ack";
@@ -0,0 +1,14 @@
+#pragma once
+
+typedef enum {
+    ESP_SLEEP_WAKEUP_UNDEFINED,
+    ESP_SLEEP_WAKEUP_TIMER,
+    ESP_SLEEP_WAKEUP_GPIO,
+} esp_sleep_wakeup_cause_t;
+
+// Wake cause reported to the code under test
+inline esp_sleep_wakeup_cause_t esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+
+inline esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() {
+    return esp_sleep_stub_wakeup_cause;
+}
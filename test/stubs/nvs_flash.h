@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// In-memory NVS for host tests
+
+typedef int esp_err_t;
+typedef uint32_t nvs_handle_t;
+typedef nvs_handle_t nvs_handle;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE,
+} nvs_open_mode_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NVS_NOT_FOUND   0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH 0x110c
+
+inline std::vector<std::string> nvs_stub_namespaces;
+inline std::map<std::string, std::vector<uint8_t>> nvs_stub_data;
+
+inline void nvs_stub_reset() {
+    nvs_stub_namespaces.clear();
+    nvs_stub_data.clear();
+}
+
+inline std::string nvs_stub_key(nvs_handle_t handle, const char *key) {
+    return nvs_stub_namespaces[handle] + "/" + key;
+}
+
+inline esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle) {
+    for (size_t i=0; i<nvs_stub_namespaces.size(); i++) {
+        if (nvs_stub_namespaces[i]==name) {
+            *handle = i;
+            return ESP_OK;
+        }
+    }
+    if (mode==NVS_READONLY) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    nvs_stub_namespaces.push_back(name);
+    *handle = nvs_stub_namespaces.size()-1;
+    return ESP_OK;
+}
+
+inline void nvs_close(nvs_handle_t handle) {
+}
+
+inline esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+inline esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    auto data = (const uint8_t*)value;
+    nvs_stub_data[nvs_stub_key(handle, key)] = std::vector<uint8_t>(data, data+length);
+    return ESP_OK;
+}
+
+inline esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length) {
+    auto it = nvs_stub_data.find(nvs_stub_key(handle, key));
+    if (it==nvs_stub_data.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (*length<it->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(value, it->second.data(), it->second.size());
+    *length = it->second.size();
+    return ESP_OK;
+}
+
+inline esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value) {
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+inline esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value) {
+    size_t sz = sizeof(*value);
+    return nvs_get_blob(handle, key, value, &sz);
+}
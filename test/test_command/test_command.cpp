@@ -0,0 +1,190 @@
+#include <string.h>
+#include <deque>
+#include <string>
+#include <unity.h>
+
+#include "esp_sleep.h"
+#include "nvs_flash.h"
+#include "command.h"
+
+
+static constexpr uint64_t DEFAULT_SLEEP_US { 60ull*60ull*1000000ull };
+
+
+/*
+ * Broker stand-in holding the device's persistent session. Commands published
+ * while the device sleeps are queued and delivered in order on the next wake,
+ * where the device applies them and acks them all in a single publish.
+ */
+class Broker {
+public:
+    void publish(const char *payload) {
+        queue.push_back(payload);
+    }
+
+    void wake() {
+        char ack[256];
+        size_t ack_len = 0;
+
+        esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_TIMER;
+        command_init();
+        while (!queue.empty()) {
+            auto &msg = queue.front();
+            ack_len += command_process(msg.data(), msg.size(), ack+ack_len, sizeof(ack)-ack_len);
+            queue.pop_front();
+        }
+        if (ack_len) {
+            acks.push_back(std::string(ack, ack_len));
+        }
+    }
+
+    std::deque<std::string> queue;
+    std::deque<std::string> acks;
+};
+
+
+static std::string process(const char *payload) {
+    char ack[256];
+    size_t len = command_process(payload, strlen(payload), ack, sizeof(ack));
+    return std::string(ack, len);
+}
+
+
+void setUp() {
+    nvs_stub_reset();
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    command_init();
+    command_take_ring();
+}
+
+void tearDown() {
+}
+
+
+
+static void test_apply_and_ack() {
+    TEST_ASSERT_EQUAL_STRING("1 ok\n2 ok\n3 ok\n", process("1 mute 1\n2 sleep 30\n3 ring").c_str());
+    TEST_ASSERT_TRUE(command_muted());
+    TEST_ASSERT_EQUAL_UINT64(30ull*60ull*1000000ull, command_sleep_duration_us(DEFAULT_SLEEP_US));
+    TEST_ASSERT_TRUE(command_take_ring());
+    TEST_ASSERT_FALSE(command_take_ring());
+}
+
+static void test_duplicate_sequence() {
+    TEST_ASSERT_EQUAL_STRING("5 ok\n", process("5 ring").c_str());
+    TEST_ASSERT_TRUE(command_take_ring());
+
+    // Retained message delivered again, and an older sequence number
+    TEST_ASSERT_EQUAL_STRING("5 dup\n4 dup\n", process("5 ring\n4 mute 1").c_str());
+    TEST_ASSERT_FALSE(command_take_ring());
+    TEST_ASSERT_FALSE(command_muted());
+}
+
+static void test_invalid_arguments() {
+    TEST_ASSERT_EQUAL_STRING("1 error\n1 error\n1 error\n1 error\n1 error\n",
+        process("1 mute foo\n1 mute 2\n1 sleep abc\n1 sleep 100000\n1 bogus").c_str());
+    TEST_ASSERT_FALSE(command_muted());
+    TEST_ASSERT_EQUAL_UINT64(DEFAULT_SLEEP_US, command_sleep_duration_us(DEFAULT_SLEEP_US));
+
+    // Errors do not consume the sequence number, so a corrected retry applies
+    TEST_ASSERT_EQUAL_STRING("1 ok\n", process("1 mute 1").c_str());
+    TEST_ASSERT_TRUE(command_muted());
+}
+
+static void test_missing_sequence() {
+    TEST_ASSERT_EQUAL_STRING("mute error\n2 ok\n", process("mute 1\n\n2 mute 1\r\n").c_str());
+}
+
+static void test_invalid_sequence() {
+    TEST_ASSERT_EQUAL_STRING("-1 error\n4294967296 error\n9999999999 error\n1x error\n2 ok\n",
+        process("-1 mute 0\n4294967296 ring\n99999999999999999999999 ring\n1x ring\n2 mute 1").c_str());
+    TEST_ASSERT_TRUE(command_muted());
+    TEST_ASSERT_FALSE(command_take_ring());
+
+    // The rejected lines did not advance the sequence number, even after a cold boot
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    command_init();
+    TEST_ASSERT_EQUAL_STRING("3 ok\n", process("3 ring").c_str());
+    TEST_ASSERT_EQUAL_STRING("4294967295 ok\n", process("4294967295 mute 0").c_str());
+}
+
+static void test_sleep_default() {
+    process("1 sleep 5\n2 sleep 0");
+    TEST_ASSERT_EQUAL_UINT64(DEFAULT_SLEEP_US, command_sleep_duration_us(DEFAULT_SLEEP_US));
+}
+
+static void test_ack_overflow() {
+    char ack[40];
+    const char payload[] = "1 sleep 1\n2 sleep 2\n3 sleep 3\n4 sleep 4\n5 sleep 5\n6 sleep 6\n7 sleep 7";
+    size_t len = command_process(payload, strlen(payload), ack, sizeof(ack));
+
+    // Lines that could not be acked are not applied either
+    TEST_ASSERT_EQUAL_STRING("1 ok\n2 ok\n3 ok\n4 ok\n5 ok\n", std::string(ack, len).c_str());
+    TEST_ASSERT_EQUAL_UINT64(5ull*60ull*1000000ull, command_sleep_duration_us(DEFAULT_SLEEP_US));
+
+    // So a retry of the dropped ones applies them
+    TEST_ASSERT_EQUAL_STRING("5 dup\n6 ok\n7 ok\n", process("5 sleep 5\n6 sleep 6\n7 sleep 7").c_str());
+    TEST_ASSERT_EQUAL_UINT64(7ull*60ull*1000000ull, command_sleep_duration_us(DEFAULT_SLEEP_US));
+}
+
+static void test_payload_too_large() {
+    std::string payload = "1 ring\n";
+    payload.append(300, ' ');
+
+    char ack[64];
+    TEST_ASSERT_EQUAL(0, command_process(payload.data(), payload.size(), ack, sizeof(ack)));
+    TEST_ASSERT_FALSE(command_take_ring());
+}
+
+static void test_state_survives_cold_boot() {
+    process("7 mute 1");
+
+    // RTC memory lost, state comes back from NVS
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    command_init();
+    TEST_ASSERT_TRUE(command_muted());
+    TEST_ASSERT_EQUAL_STRING("7 dup\n", process("7 mute 1").c_str());
+}
+
+static void test_broker_queued_while_asleep() {
+    Broker broker;
+
+    broker.publish("1 mute 1");
+    broker.publish("2 sleep 15\n3 ring");
+    broker.wake();
+
+    TEST_ASSERT_EQUAL(1, broker.acks.size());
+    TEST_ASSERT_EQUAL_STRING("1 ok\n2 ok\n3 ok\n", broker.acks.front().c_str());
+    TEST_ASSERT_TRUE(command_muted());
+    TEST_ASSERT_TRUE(command_take_ring());
+
+    // Nothing pending, nothing to ack
+    broker.acks.clear();
+    broker.wake();
+    TEST_ASSERT_EQUAL(0, broker.acks.size());
+    TEST_ASSERT_TRUE(command_muted());
+    TEST_ASSERT_EQUAL_UINT64(15ull*60ull*1000000ull, command_sleep_duration_us(DEFAULT_SLEEP_US));
+
+    // A retained command is redelivered on every wake without effect
+    broker.publish("3 ring");
+    broker.wake();
+    TEST_ASSERT_EQUAL_STRING("3 dup\n", broker.acks.front().c_str());
+    TEST_ASSERT_FALSE(command_take_ring());
+}
+
+
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_apply_and_ack);
+    RUN_TEST(test_duplicate_sequence);
+    RUN_TEST(test_invalid_arguments);
+    RUN_TEST(test_missing_sequence);
+    RUN_TEST(test_invalid_sequence);
+    RUN_TEST(test_sleep_default);
+    RUN_TEST(test_ack_overflow);
+    RUN_TEST(test_payload_too_large);
+    RUN_TEST(test_state_survives_cold_boot);
+    RUN_TEST(test_broker_queued_while_asleep);
+    return UNITY_END();
+}
@@ -0,0 +1,154 @@
+#include <string.h>
+#include <string>
+#include <unity.h>
+
+#include "esp_sleep.h"
+#include "nvs_flash.h"
+#include "discovery.h"
+
+
+static constexpr char NODE_ID[] = "doorbell_aabbccddeeff";
+static constexpr char BROKER[] = "mqtt://192.168.1.2";
+static constexpr DiscoveryFirmware FIRMWARE = { "0123456789abcdef", "1.0" };
+
+static constexpr size_t MAX_ENTITIES { 16 };
+
+
+static const DiscoveryEntity *find(const char *object_id) {
+    for (size_t i=0; i<DISCOVERY_ENTITY_COUNT; i++) {
+        if (strcmp(DISCOVERY_ENTITIES[i].object_id, object_id)==0) {
+            return &DISCOVERY_ENTITIES[i];
+        }
+    }
+    TEST_FAIL_MESSAGE(object_id);
+    return nullptr;
+}
+
+
+static std::string build(const char *object_id) {
+    const char *topic;
+    return discovery_build(*find(object_id), NODE_ID, FIRMWARE, &topic);
+}
+
+
+static uint32_t hash(const DiscoveryEntity *entities = DISCOVERY_ENTITIES, const DiscoveryFirmware &firmware = FIRMWARE, const char *broker = BROKER) {
+    return discovery_hash(entities, DISCOVERY_ENTITY_COUNT, NODE_ID, firmware, broker);
+}
+
+
+void setUp() {
+    nvs_stub_reset();
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+void tearDown() {
+}
+
+
+
+static void test_build_payload() {
+    const char *topic;
+    const char *payload = discovery_build(*find("button"), NODE_ID, FIRMWARE, &topic);
+    TEST_ASSERT_EQUAL_STRING("homeassistant/binary_sensor/doorbell_aabbccddeeff/button/config", topic);
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"name\":\"Button\",\"uniq_id\":\"doorbell_aabbccddeeff_button\",\"stat_t\":\"doorbell/button\","
+        "\"pl_on\":\"on\",\"pl_off\":\"off\","
+        "\"dev\":{\"ids\":[\"doorbell_aabbccddeeff\"],\"name\":\"Doorbell\",\"mdl\":\"XIAO ESP32C3\",\"sw\":\"1.0\"}}",
+        payload);
+}
+
+static void test_build_payload_without_extra() {
+    DiscoveryEntity entity = { "sensor", "test", "Test", "doorbell/test", nullptr };
+    const char *topic;
+    const char *payload = discovery_build(entity, NODE_ID, FIRMWARE, &topic);
+    TEST_ASSERT_NOT_NULL(strstr(payload, "\"stat_t\":\"doorbell/test\",\"dev\":{"));
+}
+
+static void test_build_all_entities() {
+    for (size_t i=0; i<DISCOVERY_ENTITY_COUNT; i++) {
+        const char *topic;
+        std::string payload = discovery_build(DISCOVERY_ENTITIES[i], NODE_ID, FIRMWARE, &topic);
+        // Not truncated
+        TEST_ASSERT_EQUAL_STRING("\"}}", payload.substr(payload.size()-3).c_str());
+        TEST_ASSERT_NOT_NULL(strstr(topic, DISCOVERY_ENTITIES[i].object_id));
+    }
+}
+
+static void test_command_entities() {
+    // Everything the command channel accepts is exposed, with a generated sequence number
+    const char *seq = "\"cmd_t\":\"doorbell/command\",\"cmd_tpl\":\"{{ now().timestamp() | int }} ";
+    TEST_ASSERT_NOT_NULL(strstr(build("mute").c_str(), (std::string(seq)+"mute {{ value }}\"").c_str()));
+    TEST_ASSERT_NOT_NULL(strstr(build("mute").c_str(), "\"stat_t\":\"doorbell/mute\""));
+    TEST_ASSERT_NOT_NULL(strstr(build("sleep").c_str(), (std::string(seq)+"sleep {{ value | int }}\"").c_str()));
+    TEST_ASSERT_NOT_NULL(strstr(build("sleep").c_str(), "\"stat_t\":\"doorbell/sleep\""));
+    TEST_ASSERT_NOT_NULL(strstr(build("ring").c_str(), (std::string(seq)+"ring\"").c_str()));
+    TEST_ASSERT_NULL(strstr(build("ring").c_str(), "stat_t"));
+    TEST_ASSERT_NOT_NULL(strstr(build("command_ack").c_str(), "\"stat_t\":\"doorbell/command/ack\""));
+}
+
+static void test_hash_stable() {
+    uint32_t first = hash();
+    TEST_ASSERT_EQUAL_UINT32(first, hash());
+
+    // Building a payload in between does not disturb the hash
+    const char *topic;
+    discovery_build(DISCOVERY_ENTITIES[2], "other", FIRMWARE, &topic);
+    TEST_ASSERT_EQUAL_UINT32(first, hash());
+}
+
+static void test_hash_changes_with_broker() {
+    TEST_ASSERT_NOT_EQUAL_UINT32(hash(), hash(DISCOVERY_ENTITIES, FIRMWARE, "mqtt://192.168.1.3"));
+}
+
+static void test_hash_changes_with_firmware() {
+    DiscoveryFirmware rebuilt = { "fedcba9876543210", FIRMWARE.version };
+    DiscoveryFirmware released = { FIRMWARE.id, "1.1" };
+    TEST_ASSERT_NOT_EQUAL_UINT32(hash(), hash(DISCOVERY_ENTITIES, rebuilt));
+    TEST_ASSERT_NOT_EQUAL_UINT32(hash(), hash(DISCOVERY_ENTITIES, released));
+}
+
+static void test_hash_changes_with_payload() {
+    DiscoveryEntity entities[MAX_ENTITIES];
+    TEST_ASSERT_LESS_THAN(MAX_ENTITIES+1, DISCOVERY_ENTITY_COUNT);
+    memcpy(entities, DISCOVERY_ENTITIES, DISCOVERY_ENTITY_COUNT*sizeof(entities[0]));
+    entities[1].name = "Voltage";
+    TEST_ASSERT_NOT_EQUAL_UINT32(hash(), hash(entities));
+
+    memcpy(entities, DISCOVERY_ENTITIES, DISCOVERY_ENTITY_COUNT*sizeof(entities[0]));
+    entities[2].state_topic = "doorbell/battery";
+    TEST_ASSERT_NOT_EQUAL_UINT32(hash(), hash(entities));
+}
+
+static void test_needed_until_stored() {
+    uint32_t h = hash();
+    TEST_ASSERT_TRUE(discovery_needed(h));
+    discovery_store(h);
+
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_TIMER;
+    TEST_ASSERT_FALSE(discovery_needed(h));
+    TEST_ASSERT_TRUE(discovery_needed(h+1));
+
+    // RTC memory lost, the hash comes back from NVS
+    esp_sleep_stub_wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    TEST_ASSERT_FALSE(discovery_needed(h));
+
+    // Erased NVS on a cold boot
+    nvs_stub_reset();
+    TEST_ASSERT_TRUE(discovery_needed(h));
+}
+
+
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_build_payload);
+    RUN_TEST(test_build_payload_without_extra);
+    RUN_TEST(test_build_all_entities);
+    RUN_TEST(test_command_entities);
+    RUN_TEST(test_hash_stable);
+    RUN_TEST(test_hash_changes_with_broker);
+    RUN_TEST(test_hash_changes_with_firmware);
+    RUN_TEST(test_hash_changes_with_payload);
+    RUN_TEST(test_needed_until_stored);
+    return UNITY_END();
+}
@@ -0,0 +1,184 @@
+#include <string.h>
+#include <map>
+#include <string>
+#include <unity.h>
+
+#include "mqtt_wire.h"
+#include "topics.h"
+
+
+static constexpr char CLIENT_ID[] = "doorbell_aabbccddeeff";
+static constexpr char USER[] = "homeassistant";
+static constexpr char PASSWORD[] = "0123456789abcdef";
+static constexpr size_t BROKER_CONNACK_PROPERTIES { 1+2 }; // Topic alias maximum
+
+
+struct Retained {
+    std::string data;
+    uint32_t expiry_s;
+};
+
+
+/*
+ * Broker stand-in: receives the messages the firmware builds, keeps the
+ * retained ones, and counts the bytes on air through the same accounting
+ * the firmware logs.
+ */
+class Broker {
+public:
+    Broker(bool v5, const char *wake_cause) : conn { v5, v5 ? wake_cause : nullptr, 0 } {
+        wire_connect(conn, strlen(CLIENT_ID), strlen(USER), strlen(PASSWORD), BROKER_CONNACK_PROPERTIES);
+    }
+
+    void receive(const WireMessage &msg) {
+        wire_publish(conn, msg);
+        if (msg.retain) {
+            retained[msg.topic] = { std::string(msg.data, msg.len), conn.v5 ? msg.expiry_s : 0 };
+        }
+    }
+
+    size_t disconnect() {
+        wire_disconnect(conn);
+        return conn.bytes;
+    }
+
+    WireConnection conn;
+    std::map<std::string, Retained> retained;
+};
+
+
+// Publishes in the order network.cpp sends them
+static void send_battery(Broker &broker, uint32_t voltage_mv, uint32_t percent) {
+    char buf[32];
+    broker.receive(wire_battery_voltage_message(voltage_mv, buf, sizeof(buf)));
+    broker.receive(wire_battery_percent_message(percent, buf, sizeof(buf)));
+}
+
+
+static size_t timer_wake(bool v5) {
+    Broker broker(v5, "timer");
+    send_battery(broker, 4050, 80);
+    return broker.disconnect();
+}
+
+
+static size_t button_wake(bool v5) {
+    Broker broker(v5, "gpio");
+    broker.receive(wire_button_message(true));
+    broker.receive(wire_button_message(false));
+    send_battery(broker, 4050, 80);
+    TEST_ASSERT_EQUAL_STRING("off", broker.retained[MQTT_BUTTON_TOPIC].data.c_str());
+    return broker.disconnect();
+}
+
+
+static size_t command_wake(bool v5) {
+    Broker broker(v5, "timer");
+    send_battery(broker, 4050, 80);
+    const char ack[] = "1 ok\n2 ok\n";
+    char buf[16];
+    broker.receive(wire_command_ack_message(ack, strlen(ack)));
+    broker.receive(wire_mute_message(true));
+    broker.receive(wire_sleep_message(30, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, broker.retained.count(MQTT_COMMAND_ACK_TOPIC));
+    TEST_ASSERT_EQUAL_STRING("1", broker.retained[MQTT_MUTE_TOPIC].data.c_str());
+    TEST_ASSERT_EQUAL_STRING("30", broker.retained[MQTT_SLEEP_TOPIC].data.c_str());
+    return broker.disconnect();
+}
+
+
+static void report(const char *name, size_t v311, size_t v5) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%s wake: MQTT 3.1.1 %u bytes, MQTT 5 %u bytes", name, (unsigned)v311, (unsigned)v5);
+    TEST_MESSAGE(buf);
+}
+
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+
+
+static void test_messages() {
+    char buf[32];
+    auto msg = wire_battery_voltage_message(4050, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING(MQTT_BATTERY_VOLTAGE_TOPIC, msg.topic);
+    TEST_ASSERT_EQUAL_STRING("4.05", std::string(msg.data, msg.len).c_str());
+    TEST_ASSERT_TRUE(msg.wake_property);
+
+    msg = wire_button_message(true);
+    TEST_ASSERT_EQUAL_STRING("on", std::string(msg.data, msg.len).c_str());
+    TEST_ASSERT_TRUE(msg.retain);
+    TEST_ASSERT_NOT_EQUAL(0, msg.expiry_s);
+
+    // The release is the resting state and does not expire
+    msg = wire_button_message(false);
+    TEST_ASSERT_EQUAL(0, msg.expiry_s);
+}
+
+static void test_publish_size() {
+    // 1 byte header, 1 byte length, 2+15 topic, 2 packet id, 3 payload, 4 byte PUBACK
+    WireConnection conn = { false, nullptr, 0 };
+    TEST_ASSERT_EQUAL(24+4, wire_publish(conn, wire_button_message(false)));
+
+    // Empty property length
+    conn = { true, nullptr, 0 };
+    TEST_ASSERT_EQUAL(25+4, wire_publish(conn, wire_button_message(false)));
+    // Message expiry property
+    TEST_ASSERT_EQUAL(23+1+5+4, wire_publish(conn, wire_button_message(true)));
+    TEST_ASSERT_EQUAL(25+4+23+1+5+4, conn.bytes);
+}
+
+static void test_timer_wake_bytes() {
+    size_t v311 = timer_wake(false);
+    size_t v5 = timer_wake(true);
+    report("Timer", v311, v5);
+    TEST_ASSERT_EQUAL(148, v311);
+    TEST_ASSERT_EQUAL(174, v5);
+}
+
+static void test_button_wake_bytes() {
+    size_t v311 = button_wake(false);
+    size_t v5 = button_wake(true);
+    report("Button", v311, v5);
+    TEST_ASSERT_EQUAL(203, v311);
+    TEST_ASSERT_EQUAL(235, v5);
+}
+
+static void test_command_wake_bytes() {
+    size_t v311 = command_wake(false);
+    size_t v5 = command_wake(true);
+    report("Command", v311, v5);
+    // Ack, mute and sleep state on top of a timer wake, MQTT 5 adds an empty property length to each
+    TEST_ASSERT_EQUAL(148+40+24+26, v311);
+    TEST_ASSERT_EQUAL(174+41+25+27, v5);
+}
+
+static void test_button_press_expires() {
+    Broker broker(true, "gpio");
+    broker.receive(wire_button_message(true));
+    TEST_ASSERT_NOT_EQUAL(0, broker.retained[MQTT_BUTTON_TOPIC].expiry_s);
+    broker.receive(wire_button_message(false));
+    TEST_ASSERT_EQUAL(0, broker.retained[MQTT_BUTTON_TOPIC].expiry_s);
+
+    // 3.1.1 has no expiry, the press stays retained until the release
+    Broker v311(false, "gpio");
+    v311.receive(wire_button_message(true));
+    TEST_ASSERT_EQUAL(0, v311.retained[MQTT_BUTTON_TOPIC].expiry_s);
+}
+
+
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_messages);
+    RUN_TEST(test_publish_size);
+    RUN_TEST(test_timer_wake_bytes);
+    RUN_TEST(test_button_wake_bytes);
+    RUN_TEST(test_command_wake_bytes);
+    RUN_TEST(test_button_press_expires);
+    return UNITY_END();
+}